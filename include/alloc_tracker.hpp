@@ -0,0 +1,63 @@
+#ifndef ALLOC_TRACKER_HPP
+#define ALLOC_TRACKER_HPP
+
+#include <string>
+#include <cstdint>
+#include <sstream>
+
+#include <sys/resource.h>
+
+// Opt-in counting of heap allocations, enabled by configuring with
+// `--with-alloc-tracking`. The global operator new/delete in
+// src/alloc_tracker.cpp count into thread-local counters, reading the totals
+// sums up the counters of all threads.
+
+struct alloc_stats {
+  uint64_t allocations;
+  uint64_t bytes;
+  uint64_t deallocations;
+};
+
+#ifdef ALLOC_TRACKING
+
+constexpr bool alloc_tracking = true;
+
+// process-wide totals since startup
+alloc_stats alloc_totals();
+
+#else // ALLOC_TRACKING
+
+constexpr bool alloc_tracking = false;
+
+inline alloc_stats alloc_totals() {
+  return {0, 0, 0};
+}
+
+#endif // ALLOC_TRACKING
+
+// maximum resident set size in kilobytes
+inline uint64_t peak_rss_kb() {
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return static_cast<uint64_t>(usage.ru_maxrss);
+}
+
+// Renders allocations per message since `last` and the number of live
+// allocations, which stays flat if buffers are pooled, and updates `last`.
+// Returns an empty string if tracking is disabled.
+inline std::string alloc_report(alloc_stats& last, uint64_t messages) {
+  if (!alloc_tracking)
+    return {};
+  auto now = alloc_totals();
+  auto msgs = messages > 0 ? messages * 1.0 : 1.0;
+  std::ostringstream out;
+  out << ", " << ((now.allocations - last.allocations) / msgs)
+      << " allocs/msg, " << ((now.bytes - last.bytes) / msgs)
+      << " bytes/msg, " << (now.allocations - now.deallocations)
+      << " live allocs, peak RSS " << peak_rss_kb() << " KB";
+  last = now;
+  return out.str();
+}
+
+#endif // ALLOC_TRACKER_HPP
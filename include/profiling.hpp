@@ -0,0 +1,194 @@
+#ifndef PROFILING_HPP
+#define PROFILING_HPP
+
+#include <deque>
+#include <mutex>
+#include <cerrno>
+#include <string>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <condition_variable>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <caf/actor_ostream.hpp>
+
+// -----------------------------------------------------------------------------
+//  HOT PATH MARKERS
+// -----------------------------------------------------------------------------
+
+// Statically defined tracing points around hot-path sections, compiled to a
+// nop if <sys/sdt.h> is not available. List and record them with:
+//   perf buildid-cache --add <binary>
+//   perf probe 'sdt_caf_net:*'
+//   perf record -e 'sdt_caf_net:*' ...
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define HOT_PATH_BEGIN(name) DTRACE_PROBE(caf_net, name##_begin)
+#define HOT_PATH_END(name) DTRACE_PROBE(caf_net, name##_end)
+#else
+#define HOT_PATH_BEGIN(name) static_cast<void>(0)
+#define HOT_PATH_END(name) static_cast<void>(0)
+#endif
+
+// -----------------------------------------------------------------------------
+//  PERF CONTROL
+// -----------------------------------------------------------------------------
+
+// Enables and disables the events of `perf record --delay=-1 --control ...`
+// to profile only the steady-state phase of a benchmark. The control and ack
+// descriptors are passed via PERF_CTL_FD and PERF_ACK_FD or, e.g., when
+// running perf via sudo, as FIFO paths via PERF_CTL_FIFO and PERF_ACK_FIFO.
+// Commands are written by a background thread, callers never block on perf.
+class perf_control {
+public:
+  static perf_control& instance() {
+    static perf_control x;
+    return x;
+  }
+
+  ~perf_control() {
+    {
+      std::lock_guard<std::mutex> guard{mtx_};
+      stop_ = true;
+    }
+    cv_.notify_one();
+    if (worker_.joinable())
+      worker_.join();
+  }
+
+  // enables events once the first caller enters a profiled phase, returns
+  // whether this call issued the command
+  bool enter() {
+    std::lock_guard<std::mutex> guard{mtx_};
+    if (ctl_fd_ < 0 || active_++ > 0)
+      return false;
+    push("enable");
+    return true;
+  }
+
+  // disables events once the last caller left its profiled phase, returns
+  // whether this call issued the command
+  bool leave() {
+    std::lock_guard<std::mutex> guard{mtx_};
+    if (active_ == 0 || --active_ > 0)
+      return false;
+    push("disable");
+    return true;
+  }
+
+private:
+  // perf acks within milliseconds, anything longer means it is gone
+  static constexpr int ack_timeout_ms = 1000;
+
+  perf_control() : ctl_fd_(-1), ack_fd_(-1), active_(0), stop_(false) {
+    ctl_fd_ = open_fd("PERF_CTL_FD", "PERF_CTL_FIFO");
+    ack_fd_ = open_fd("PERF_ACK_FD", "PERF_ACK_FIFO");
+    if (ctl_fd_ >= 0)
+      worker_ = std::thread{[this] { run(); }};
+  }
+
+  static int open_fd(const char* fd_var, const char* fifo_var) {
+    if (auto fd = getenv(fd_var))
+      return atoi(fd);
+    // read-write open on a FIFO does not block waiting for the other side
+    if (auto path = getenv(fifo_var))
+      return ::open(path, O_RDWR | O_CLOEXEC);
+    return -1;
+  }
+
+  // requires mtx_ to be locked
+  void push(const char* cmd) {
+    queue_.emplace_back(cmd);
+    cv_.notify_one();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> guard{mtx_};
+    for (;;) {
+      cv_.wait(guard, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty())
+        return;
+      auto cmd = std::move(queue_.front());
+      queue_.pop_front();
+      guard.unlock();
+      command(cmd);
+      guard.lock();
+    }
+  }
+
+  // runs outside of any actor, hence reports errors to stderr directly
+  void command(const std::string& cmd) {
+    auto line = cmd + '\n';
+    if (write(ctl_fd_, line.data(), line.size())
+        != static_cast<ssize_t>(line.size())) {
+      std::cerr << "[profile] cannot write to perf control: "
+                << strerror(errno) << std::endl;
+      return;
+    }
+    if (ack_fd_ < 0)
+      return;
+    pollfd pfd{ack_fd_, POLLIN, 0};
+    char buf[16];
+    if (poll(&pfd, 1, ack_timeout_ms) <= 0
+        || read(ack_fd_, buf, sizeof(buf)) <= 0)
+      std::cerr << "[profile] no ack from perf for " << cmd << std::endl;
+  }
+
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::deque<std::string> queue_;
+  std::thread worker_;
+  int ctl_fd_;
+  int ack_fd_;
+  size_t active_;
+  bool stop_;
+};
+
+// Tracks whether the owning actor is inside a profiled phase. Entering and
+// leaving takes the actor to log through its aout.
+class profile_window {
+public:
+  profile_window() : inside_(false) {
+    // nop
+  }
+
+  profile_window(const profile_window&) = delete;
+  profile_window& operator=(const profile_window&) = delete;
+
+  ~profile_window() {
+    if (inside_)
+      perf_control::instance().leave();
+  }
+
+  template <class Self>
+  void enter(Self* self, const char* phase) {
+    if (inside_)
+      return;
+    inside_ = true;
+    phase_ = phase;
+    if (perf_control::instance().enter())
+      caf::aout(self) << "[profile] enabling perf events, phase " << phase_
+                      << std::endl;
+  }
+
+  template <class Self>
+  void leave(Self* self) {
+    if (!inside_)
+      return;
+    inside_ = false;
+    if (perf_control::instance().leave())
+      caf::aout(self) << "[profile] disabling perf events, phase " << phase_
+                      << std::endl;
+  }
+
+private:
+  bool inside_;
+  std::string phase_;
+};
+
+#endif // PROFILING_HPP
@@ -0,0 +1,263 @@
+#ifndef RUN_SUMMARY_HPP
+#define RUN_SUMMARY_HPP
+
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sstream>
+#include <algorithm>
+
+#include <sys/resource.h>
+
+#include <caf/meta/type_name.hpp>
+
+// -----------------------------------------------------------------------------
+//  LATENCY HISTOGRAM
+// -----------------------------------------------------------------------------
+
+// Histogram for latencies in microseconds. Values below 1024 are stored
+// exactly, larger values in 64 buckets per power of two (< 1.6% error).
+class latency_histogram {
+public:
+  latency_histogram()
+      : buckets_(bucket_count, 0),
+        count_(0),
+        sum_(0),
+        max_(0) {
+    // nop
+  }
+
+  void record(uint64_t us) {
+    ++buckets_[index(us)];
+    ++count_;
+    sum_ += us;
+    max_ = std::max(max_, us);
+  }
+
+  // returns the smallest value with `p` of all values being less or equal
+  uint64_t percentile(double p) const {
+    if (count_ == 0)
+      return 0;
+    auto rank = static_cast<uint64_t>(std::ceil(p * count_));
+    rank = std::max(rank, uint64_t{1});
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets_.size(); ++i) {
+      seen += buckets_[i];
+      if (seen >= rank)
+        return std::min(upper_bound(i), max_);
+    }
+    return max_;
+  }
+
+  uint64_t count() const {
+    return count_;
+  }
+
+  uint64_t mean() const {
+    return count_ > 0 ? sum_ / count_ : 0;
+  }
+
+  uint64_t max() const {
+    return max_;
+  }
+
+  void reset() {
+    std::fill(buckets_.begin(), buckets_.end(), 0);
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+  }
+
+private:
+  static constexpr size_t linear = 1024;
+  static constexpr size_t linear_bits = 10;
+  static constexpr size_t sub_buckets = 64;
+  static constexpr size_t sub_bits = 6;
+  static constexpr size_t bucket_count = linear + (64 - linear_bits)
+                                                  * sub_buckets;
+
+  static size_t index(uint64_t x) {
+    if (x < linear)
+      return static_cast<size_t>(x);
+    size_t msb = 63 - static_cast<size_t>(__builtin_clzll(x));
+    auto sub = (x >> (msb - sub_bits)) & (sub_buckets - 1);
+    return linear + (msb - linear_bits) * sub_buckets
+           + static_cast<size_t>(sub);
+  }
+
+  // largest value that maps to bucket `i`
+  static uint64_t upper_bound(size_t i) {
+    if (i < linear)
+      return i;
+    auto msb = (i - linear) / sub_buckets + linear_bits;
+    uint64_t sub = (i - linear) % sub_buckets;
+    return ((sub_buckets + sub + 1) << (msb - sub_bits)) - 1;
+  }
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t max_;
+};
+
+// -----------------------------------------------------------------------------
+//  RUN SUMMARY
+// -----------------------------------------------------------------------------
+
+// Exact numbers for a whole run, sent by the server in reply to the end-of-run
+// message of a client.
+struct run_summary {
+  // as reported by the client
+  uint64_t sent;
+  uint64_t sent_us;
+  // as measured by the server
+  uint64_t received;
+  uint64_t lost;
+  uint64_t bytes;
+  // time between first and last message that arrived
+  uint64_t received_us;
+  // latency in microseconds
+  uint64_t mean;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+  // CPU time of the receiving process from the first message to the fin
+  uint64_t cpu_us;
+};
+
+// serialized size of a `run_summary`
+constexpr size_t run_summary_size = 13 * sizeof(uint64_t);
+
+template <class Inspector>
+typename Inspector::result_type inspect(Inspector& f, run_summary& x) {
+  return f(caf::meta::type_name("run_summary"), x.sent, x.sent_us, x.received,
+           x.lost, x.bytes, x.received_us, x.mean, x.p50, x.p90, x.p99,
+           x.p999, x.max, x.cpu_us);
+}
+
+inline std::string render(const run_summary& x) {
+  auto secs = std::max(x.received_us, uint64_t{1}) / 1000000.0;
+  std::ostringstream out;
+  out << "Run summary: sent " << x.sent << " in " << (x.sent_us / 1000000.0)
+      << " s, received " << x.received << ", lost " << x.lost << " ("
+      << (x.sent > 0 ? x.lost * 100.0 / x.sent : 0.0) << "%), " << x.bytes
+      << " bytes in " << secs << " s --> " << (x.received / secs)
+      << " msgs/s, " << (x.bytes * 8 / (1024.0 * 1024.0) / secs)
+      << " Mbits/s, latency mean " << x.mean << " us, p50 " << x.p50
+      << " us, p90 " << x.p90 << " us, p99 " << x.p99 << " us, p99.9 "
+      << x.p999 << " us, max " << x.max << " us, receiver CPU "
+      << (x.received > 0 ? x.cpu_us * 1.0 / x.received : 0.0) << " us/msg";
+  return out.str();
+}
+
+// user and system time of this process in microseconds
+inline uint64_t process_cpu_us() {
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  auto us = [](const timeval& x) {
+    return static_cast<uint64_t>(x.tv_sec) * 1000000
+           + static_cast<uint64_t>(x.tv_usec);
+  };
+  return us(usage.ru_utime) + us(usage.ru_stime);
+}
+
+// -----------------------------------------------------------------------------
+//  RUN TOTALS
+// -----------------------------------------------------------------------------
+
+// Accumulates the exact totals of a run on the receiving side.
+class run_totals {
+public:
+  using clock = std::chrono::steady_clock;
+
+  run_totals() : received_(0), bytes_(0), first_cpu_us_(0) {
+    // nop
+  }
+
+  void add(uint64_t bytes) {
+    auto now = clock::now();
+    if (received_ == 0) {
+      first_ = now;
+      first_cpu_us_ = process_cpu_us();
+    }
+    last_ = now;
+    ++received_;
+    bytes_ += bytes;
+  }
+
+  // ignores negative values caused by unsynchronized clocks
+  void add_latency(int64_t us) {
+    if (us >= 0)
+      latency_.record(static_cast<uint64_t>(us));
+  }
+
+  uint64_t received() const {
+    return received_;
+  }
+
+  run_summary summarize(uint64_t sent, uint64_t sent_us) const {
+    run_summary x;
+    x.sent = sent;
+    x.sent_us = sent_us;
+    x.received = received_;
+    x.lost = sent > received_ ? sent - received_ : 0;
+    x.bytes = bytes_;
+    x.received_us = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(last_ - first_)
+      .count());
+    x.mean = latency_.mean();
+    x.p50 = latency_.percentile(0.5);
+    x.p90 = latency_.percentile(0.9);
+    x.p99 = latency_.percentile(0.99);
+    x.p999 = latency_.percentile(0.999);
+    x.max = latency_.max();
+    x.cpu_us = received_ > 0 ? process_cpu_us() - first_cpu_us_ : 0;
+    return x;
+  }
+
+  void reset() {
+    received_ = 0;
+    bytes_ = 0;
+    latency_.reset();
+  }
+
+private:
+  uint64_t received_;
+  uint64_t bytes_;
+  clock::time_point first_;
+  clock::time_point last_;
+  // excludes startup and idle time before the run
+  uint64_t first_cpu_us_;
+  latency_histogram latency_;
+};
+
+// -----------------------------------------------------------------------------
+//  BROKER RECORDS
+// -----------------------------------------------------------------------------
+
+// Records exchanged by the TCP and UDP brokers, each starts with the type:
+//  data:    type, payload, 8 bytes sequence number, 8 bytes timestamp
+//  fin:     type, 8 bytes sent messages, 8 bytes sending time in us
+//  summary: type, run_summary
+enum class record_type : uint8_t {
+  data,
+  // end of run, sent by the client after its last block
+  fin,
+  // answer to fin
+  summary
+};
+
+constexpr uint8_t to_byte(record_type x) {
+  return static_cast<uint8_t>(x);
+}
+
+// Overhead of a data record. The payload size is variable-length encoded, 2
+// bytes for 128 to 16383 bytes of payload, i.e., records can differ by a byte.
+constexpr uint32_t record_overhead = 1 + 2 + 8 + 8;
+
+#endif // RUN_SUMMARY_HPP
@@ -1,10 +1,16 @@
-
+#include <map>
 #include <chrono>
+#include <numeric>
+#include <functional>
 #include <iostream>
 
 #include <caf/all.hpp>
 #include <caf/io/all.hpp>
 
+#include "run_summary.hpp"
+#include "alloc_tracker.hpp"
+#include "profiling.hpp"
+
 using namespace caf;
 using namespace std;
 
@@ -14,6 +20,11 @@ using ping_atom = caf::atom_constant<atom("ping")>;
 using reset_atom = caf::atom_constant<atom("reset")>;
 using start_atom = caf::atom_constant<atom("start")>;
 using shutdown_atom = caf::atom_constant<atom("shutdown")>;
+using report_atom = caf::atom_constant<atom("report")>;
+using done_atom = caf::atom_constant<atom("done")>;
+using ack_atom = caf::atom_constant<atom("ack")>;
+using fin_atom = caf::atom_constant<atom("fin")>;
+using drained_atom = caf::atom_constant<atom("drained")>;
 
 // 82 bytes BASP header
 //  2 bytes annotation
@@ -40,11 +51,20 @@ public:
   uint32_t bundle = 10;
   bool debug = false;
   bool udp = false;
+  bool local = false;
+  uint32_t blocks = 10;
+  uint32_t senders = 1;
+  uint32_t sinks = 1;
+  uint32_t cost = 0;
+  bool checksum = false;
+  uint32_t stages = 0;
+  uint32_t warmup = 1;
   config() {
     load<io::middleman>();
     set("middleman.enable-udp", true);
     set("middleman.enable-tcp", true);
     add_message_type<std::vector<char>>("std::vector<char>");
+    add_message_type<run_summary>("run_summary");
     opt_group{custom_options_, "global"}
       .add(port, "port,P", "set port")
       .add(udp, "udp,u", "use udp (default: tcp)")
@@ -54,6 +74,16 @@ public:
       .add(payload, "payload,p", "set payload of each message in bytes (default"
                                  ": 1024 bytes, overhead is 82+2+8 bytes)")
       .add(server, "server,s", "start a server")
+      .add(local, "local,l", "run senders and sinks in one process")
+      .add(blocks, "blocks,B", "set number of 1s blocks to send (default: 10)")
+      .add(warmup, "warmup,W", "set number of 1s blocks excluded from "
+                               "profiling at the start (default: 1)")
+      .add(senders, "senders,m", "number of sending actors (rate is per sender)")
+      .add(sinks, "sinks,k", "number of sink actors (ignored in client mode)")
+      .add(cost, "cost,c", "busy loop of c microseconds per message and stage")
+      .add(checksum, "checksum,x", "compute a checksum over each payload")
+      .add(stages, "stages,w", "number of worker actors each message passes "
+                               "before it is acknowledged (default: 0)")
       .add(debug, "debug,d", "print message size only");
   }
 };
@@ -63,89 +93,359 @@ public:
 //  SERVER
 // -----------------------------------------------------------------------------
 
+// work done for each message on the receiving side
+struct processing {
+  // busy loop iterations, calibrated from the configured cost
+  uint64_t iterations;
+  bool checksum;
+};
+
+// burns CPU without touching memory
+uint64_t busy_loop(uint64_t iterations) {
+  uint64_t x = 0;
+  for (uint64_t i = 0; i < iterations; ++i)
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+  return x;
+}
+
+// estimates how many busy loop iterations take one microsecond
+uint64_t iterations_per_us() {
+  constexpr uint64_t n = 1 << 24;
+  auto start = chrono::steady_clock::now();
+  volatile uint64_t res = busy_loop(n);
+  static_cast<void>(res);
+  auto us = chrono::duration_cast<chrono::microseconds>(
+    chrono::steady_clock::now() - start).count();
+  return max(n / static_cast<uint64_t>(max(us, decltype(us){1})), uint64_t{1});
+}
+
+// FNV-1a over the payload
+uint64_t checksum(const vector<char>& payload) {
+  uint64_t hash = 14695981039346656037ull;
+  for (auto c : payload) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// returns a digest of the work to keep the compiler from skipping it
+uint64_t process(const vector<char>& payload, const processing& p) {
+  uint64_t digest = 0;
+  if (p.iterations > 0)
+    digest += busy_loop(p.iterations);
+  if (p.checksum)
+    digest += checksum(payload);
+  return digest;
+}
+
+struct w_state {
+  uint64_t digest;
+};
+
+// delegates the current message without rebuilding it, i.e., without copying
+// the payload, the handler must not access its arguments afterwards
+template <class Self>
+void forward_current(Self* self, const actor& dest) {
+  self->delegate(dest,
+                 self->current_mailbox_element()->move_content_to_message());
+}
+
+// pipeline stage, the last one acknowledges each message to the sink,
+// messages are delegated to keep the client as sender
+behavior worker(stateful_actor<w_state>* self, actor next, bool last,
+                processing p) {
+  self->state.digest = 0;
+  return {
+    [=](const vector<char>& payload, uint32_t, caf::timestamp& ts) {
+      HOT_PATH_BEGIN(process);
+      self->state.digest += process(payload, p);
+      HOT_PATH_END(process);
+      if (last)
+        self->delegate(next, ack_atom::value, ts);
+      else
+        forward_current(self, next);
+    },
+    [=](fin_atom, uint64_t sent, uint64_t sent_us) {
+      // all earlier messages of the client passed this stage
+      if (last)
+        self->delegate(next, drained_atom::value, sent, sent_us);
+      else
+        self->delegate(next, fin_atom::value, sent, sent_us);
+    },
+    [=](shutdown_atom) {
+      if (!last)
+        self->send(next, shutdown_atom::value);
+      self->quit();
+    }
+  };
+}
+
+struct client_run {
+  // next expected sequence number
+  uint32_t next = 0;
+  run_totals totals;
+};
+
 struct statistics {
   uint32_t packets_per_interval;
   uint64_t bytes;
   uint64_t received;
+  // messages that passed the processing (and the pipeline)
+  uint64_t completed;
+  // messages currently queued in the pipeline
+  uint64_t backlog;
   uint32_t lost;
-  uint32_t next;
+  // exact numbers per client until it ends its run
+  map<actor_addr, client_run> runs;
   uint32_t timeout;
+  // a reset_atom is pending
+  bool ticking;
+  // end-to-end latency in microseconds
+  uint64_t latency_sum;
+  uint64_t latency_max;
+  // first and last completed message of the current interval
+  caf::timestamp first_completed;
+  caf::timestamp last_completed;
+  // identifies this sink in reports
+  uint32_t id;
+  actor collector;
+  // first pipeline stage, invalid if the sink processes messages itself
+  actor pipeline;
+  processing work;
+  uint64_t digest;
+  // intervals with data since leaving the idle state
+  uint32_t intervals;
+  uint32_t warmup;
+  profile_window profile;
 };
 
+// forwards the statistics of the current interval to the collector
+void report(stateful_actor<statistics>* self) {
+  auto& s = self->state;
+  self->send(s.collector, report_atom::value, s.id, s.received, s.completed,
+             s.backlog, s.bytes, s.lost, s.latency_sum, s.latency_max,
+             s.first_completed, s.last_completed);
+}
+
+client_run& current_run(stateful_actor<statistics>* self) {
+  return self->state.runs[actor_cast<actor_addr>(self->current_sender())];
+}
+
+// accounts for a message that passed all processing
+void complete(stateful_actor<statistics>* self, const caf::timestamp& ts) {
+  auto& s = self->state;
+  auto now = caf::make_timestamp();
+  if (s.completed++ == 0)
+    s.first_completed = now;
+  s.last_completed = now;
+  // one-way latency, requires synchronized clocks across nodes
+  auto latency = chrono::duration_cast<chrono::microseconds>(
+    now - ts).count();
+  current_run(self).totals.add_latency(latency);
+  if (latency > 0) {
+    s.latency_sum += static_cast<uint64_t>(latency);
+    s.latency_max = max(s.latency_max, static_cast<uint64_t>(latency));
+  }
+}
+
+void shutdown_sink(stateful_actor<statistics>* self) {
+  auto& s = self->state;
+  s.profile.leave(self);
+  if (s.pipeline)
+    self->send(s.pipeline, shutdown_atom::value);
+  self->send(s.collector, done_atom::value);
+  self->quit();
+}
+
 behavior measureing_server(stateful_actor<statistics>* self);
 
 // server while idle
 behavior idle_server(stateful_actor<statistics>* self) {
   //self->set_default_handler(skip);
+  self->state.profile.leave(self);
+  self->state.intervals = 0;
   return {
     [=](start_atom, uint32_t num_packets) {
       // new client with data ...
       auto& s = self->state;
       s.packets_per_interval = num_packets;
       s.bytes = 0;
+      s.received = 0;
+      s.completed = 0;
       s.lost = 0;
-      s.bytes = 0;
-      s.next = 0;
+      s.runs.clear();
+      // register the client, the sink idles once all clients finished
+      current_run(self);
       s.timeout = 0;
+      s.latency_sum = 0;
+      s.latency_max = 0;
       self->become(measureing_server(self));
       return start_atom::value;
     },
+    [=](ack_atom, caf::timestamp&) {
+      // straggler from the previous run
+      --self->state.backlog;
+    },
+    [=](fin_atom, uint64_t sent, uint64_t sent_us) {
+      // the run already timed out, its totals stay until the next start
+      auto& s = self->state;
+      auto i = s.runs.find(actor_cast<actor_addr>(self->current_sender()));
+      if (i == s.runs.end())
+        return run_totals{}.summarize(sent, sent_us);
+      auto summary = i->second.totals.summarize(sent, sent_us);
+      s.runs.erase(i);
+      aout(self) << "Sink " << s.id << ": " << render(summary) << endl;
+      return summary;
+    },
     [=](shutdown_atom) {
-      self->quit();
+      shutdown_sink(self);
     },
     [=](reset_atom) {
       // drop it
+      self->state.ticking = false;
     }
   };
 }
 
+// initial behavior of a sink
+behavior sink(stateful_actor<statistics>* self, uint32_t id, actor collector,
+              processing work, uint32_t stages, bool detach,
+              uint32_t warmup) {
+  auto& s = self->state;
+  s.id = id;
+  s.collector = std::move(collector);
+  s.work = work;
+  s.backlog = 0;
+  s.digest = 0;
+  s.ticking = false;
+  s.warmup = warmup;
+  // build the pipeline back to front, the last stage acknowledges to us
+  actor next = actor_cast<actor>(self);
+  for (uint32_t i = 0; i < stages; ++i) {
+    auto last = i == 0;
+    next = detach ? self->spawn<detached>(worker, next, last, work)
+                  : self->spawn(worker, next, last, work);
+  }
+  if (stages > 0)
+    s.pipeline = next;
+  return idle_server(self);
+}
+
 // server behavior while measuring data
 behavior measureing_server(stateful_actor<statistics>* self) {
-  self->delayed_send(self, interval, reset_atom::value);
+  // a tick from the previous run may still be on its way
+  if (!self->state.ticking) {
+    self->state.ticking = true;
+    self->delayed_send(self, interval, reset_atom::value);
+  }
   return {
-    [=](const vector<char>& payload, uint32_t seq, caf::timestamp&) {
+    [=](const vector<char>& payload, uint32_t seq, caf::timestamp& ts) {
       // regular data packet
+      HOT_PATH_BEGIN(receive);
       auto& s = self->state;
       // count messages that arrived
       ++s.received;
       // count bytes that arrived
       s.bytes += payload.size() + message_overhead;
-      if (seq == s.next) {
+      auto& run = current_run(self);
+      run.totals.add(payload.size() + message_overhead);
+      auto& next = run.next;
+      if (seq == next) {
         // expected message
-        ++s.next;
-      } else if (seq > s.next) {
+        ++next;
+      } else if (seq > next) {
         // skipped messages
-        s.lost += (seq - s.next);
-        s.next = seq + 1;
+        s.lost += (seq - next);
+        next = seq + 1;
       } else {
         // previously lost message
         --s.lost;
       }
+      if (s.pipeline) {
+        ++s.backlog;
+        forward_current(self, s.pipeline);
+      } else {
+        HOT_PATH_BEGIN(process);
+        s.digest += process(payload, s.work);
+        HOT_PATH_END(process);
+        complete(self, ts);
+      }
+      HOT_PATH_END(receive);
+    },
+    [=](ack_atom, caf::timestamp& ts) {
+      --self->state.backlog;
+      complete(self, ts);
+    },
+    [=](fin_atom, uint64_t sent, uint64_t sent_us) {
+      // the summary waits for all messages still in the pipeline
+      auto& s = self->state;
+      if (s.pipeline)
+        self->delegate(s.pipeline, fin_atom::value, sent, sent_us);
+      else
+        self->delegate(actor_cast<actor>(self), drained_atom::value, sent,
+                       sent_us);
+    },
+    [=](drained_atom, uint64_t sent, uint64_t sent_us) -> run_summary {
+      auto& s = self->state;
+      auto i = s.runs.find(actor_cast<actor_addr>(self->current_sender()));
+      auto summary = i != s.runs.end() ? i->second.totals.summarize(sent, sent_us)
+                                       : run_totals{}.summarize(sent, sent_us);
+      if (i != s.runs.end())
+        s.runs.erase(i);
+      aout(self) << "Sink " << s.id << ": " << render(summary) << endl;
+      if (s.runs.empty()) {
+        // last client is done, hand out the rest of this interval
+        if (s.received > 0 || s.completed > 0)
+          report(self);
+        self->become(idle_server(self));
+      }
+      return summary;
+    },
+    [=](start_atom, uint32_t num_packets) {
+      // additional client sending to this sink
+      self->state.packets_per_interval += num_packets;
+      current_run(self);
+      return start_atom::value;
     },
     [=](reset_atom) {
       self->delayed_send(self, interval, reset_atom::value);
       auto& s = self->state;
-      if (s.received == 0) {
+      if (s.received == 0 && s.completed == 0) {
         ++s.timeout;
         if (s.timeout == 3) {
-          aout(self) << "Returning to idle state!" << endl;
+          aout(self) << "Sink " << s.id << ": returning to idle state!" << endl;
           self->become(idle_server(self));
         } else {
-          aout(self) << "No messages received ..." << endl;
+          aout(self) << "Sink " << s.id << ": no messages received ..." << endl;
         }
       } else {
-        aout(self) << "Received " << s.received << " received, lost "
-                   << (s.lost * 1.0 / s.received)
+        if (++s.intervals > s.warmup)
+          s.profile.enter(self, "steady-state");
+        aout(self) << "Sink " << s.id << ": received " << s.received
+                   << " received, lost "
+                   << (s.received > 0 ? s.lost * 1.0 / s.received : 0.0)
                    << " --> " << (s.bytes / (1024.0 * 1024.0) )
-                   << " MBs/s" << std::endl;
+                   << " MBs/s, completed " << s.completed
+                   << ", backlog " << s.backlog << ", latency "
+                   << (s.completed > 0 ? s.latency_sum / s.completed : 0)
+                   << " us (max " << s.latency_max << " us)" << std::endl;
+        report(self);
         s.received = 0;
+        s.completed = 0;
         s.bytes = 0;
         s.lost = 0;
         s.timeout = 0;
+        s.latency_sum = 0;
+        s.latency_max = 0;
       }
     },
     [=](shutdown_atom) {
-      self->quit();
+      // hand the unreported rest of this interval to the collector
+      auto& s = self->state;
+      if (s.received > 0 || s.completed > 0)
+        report(self);
+      shutdown_sink(self);
     },
     after(chrono::seconds(5)) >> [=] {
       self->become(idle_server(self));
@@ -153,6 +453,139 @@ behavior measureing_server(stateful_actor<statistics>* self) {
   };
 }
 
+struct directory_state {
+  vector<actor> sinks;
+  size_t next;
+};
+
+// published entry point that assigns clients to sinks round-robin
+behavior directory(stateful_actor<directory_state>* self,
+                   vector<actor> sinks) {
+  self->state.sinks = std::move(sinks);
+  self->state.next = 0;
+  return {
+    [=](start_atom, uint32_t num_packets) {
+      auto& s = self->state;
+      auto& dest = s.sinks[s.next];
+      s.next = (s.next + 1) % s.sinks.size();
+      // the sink answers the client directly, which then sends to it
+      return self->delegate(dest, start_atom::value, num_packets);
+    },
+    [=](shutdown_atom) {
+      for (auto& x : self->state.sinks)
+        self->send(x, shutdown_atom::value);
+      self->quit();
+    }
+  };
+}
+
+struct totals {
+  uint64_t received = 0;
+  uint64_t completed = 0;
+  uint64_t backlog = 0;
+  uint64_t bytes = 0;
+  uint64_t lost = 0;
+  uint64_t latency_sum = 0;
+  uint64_t latency_max = 0;
+  // window from the first to the last completed message
+  caf::timestamp first;
+  caf::timestamp last;
+};
+
+struct collector_state {
+  uint32_t sinks;
+  uint32_t done;
+  // latest backlog reported by each sink
+  vector<uint64_t> backlogs;
+  totals current;
+  totals run;
+  // allocation counters at the last report, counted process-wide
+  alloc_stats allocs;
+};
+
+// aggregates the per-sink reports into overall numbers
+behavior collector(stateful_actor<collector_state>* self, uint32_t sinks) {
+  auto& s = self->state;
+  s.sinks = sinks;
+  s.done = 0;
+  s.backlogs.assign(sinks, 0);
+  s.allocs = alloc_totals();
+  self->delayed_send(self, interval, reset_atom::value);
+  auto add = [](totals& t, uint64_t received, uint64_t completed,
+                uint64_t bytes, uint32_t lost, uint64_t latency_sum,
+                uint64_t latency_max, const caf::timestamp& first,
+                const caf::timestamp& last) {
+    if (completed > 0) {
+      if (t.completed == 0 || first < t.first)
+        t.first = first;
+      t.last = max(t.last, last);
+    }
+    t.received += received;
+    t.completed += completed;
+    t.bytes += bytes;
+    t.lost += lost;
+    t.latency_sum += latency_sum;
+    t.latency_max = max(t.latency_max, latency_max);
+  };
+  return {
+    [=](report_atom, uint32_t id, uint64_t received, uint64_t completed,
+        uint64_t backlog, uint64_t bytes, uint32_t lost, uint64_t latency_sum,
+        uint64_t latency_max, const caf::timestamp& first,
+        const caf::timestamp& last) {
+      auto& s = self->state;
+      add(s.current, received, completed, bytes, lost, latency_sum,
+          latency_max, first, last);
+      add(s.run, received, completed, bytes, lost, latency_sum, latency_max,
+          first, last);
+      // backlog is a gauge, sum up the latest value of each sink and keep the
+      // highest total seen
+      if (id < s.backlogs.size())
+        s.backlogs[id] = backlog;
+      auto sum = accumulate(s.backlogs.begin(), s.backlogs.end(), uint64_t{0});
+      s.current.backlog = max(s.current.backlog, sum);
+      s.run.backlog = max(s.run.backlog, sum);
+    },
+    [=](reset_atom) {
+      self->delayed_send(self, interval, reset_atom::value);
+      auto& s = self->state;
+      auto& c = s.current;
+      if (c.received == 0 && c.completed == 0) {
+        s.allocs = alloc_totals();
+        return;
+      }
+      if (s.sinks > 1 || alloc_tracking)
+        aout(self) << "Overall: received " << c.received << " received, lost "
+                   << (c.received > 0 ? c.lost * 1.0 / c.received : 0.0)
+                   << " --> " << (c.bytes / (1024.0 * 1024.0))
+                   << " MBs/s, completed " << c.completed
+                   << ", backlog " << c.backlog << ", latency "
+                   << (c.completed > 0 ? c.latency_sum / c.completed : 0)
+                   << " us (max " << c.latency_max << " us)"
+                   << alloc_report(s.allocs, c.received) << endl;
+      c = totals{};
+    },
+    [=](done_atom) {
+      auto& s = self->state;
+      if (++s.done < s.sinks)
+        return;
+      auto& r = s.run;
+      // divide by the measured time, collector ticks do not align with sinks
+      auto us = chrono::duration_cast<chrono::microseconds>(r.last - r.first);
+      auto secs = us.count() > 0 ? us.count() / 1000000.0 : 1.0;
+      auto threads = self->system().scheduler().num_workers();
+      // single line for the scheduler sweep in 'topology'
+      aout(self) << "TOPOLOGY " << threads << " " << s.sinks << " "
+                 << static_cast<uint64_t>(r.completed / secs) << " "
+                 << (r.bytes / (1024.0 * 1024.0) / secs) << " "
+                 << (r.completed > 0 ? r.latency_sum / r.completed : 0) << " "
+                 << r.latency_max << " "
+                 << (r.received > 0 ? r.lost * 1.0 / r.received : 0.0) << " "
+                 << r.backlog << endl;
+      self->quit();
+    }
+  };
+}
+
 // -----------------------------------------------------------------------------
 //  CLIENT
 // -----------------------------------------------------------------------------
@@ -165,24 +598,69 @@ struct c_state {
   uint32_t packets;
   uint32_t bundle;
   caf::duration timeout;
+  uint32_t blocks;
+  uint32_t current_block;
+  chrono::steady_clock::time_point start;
+  // allocation counters at the last report
+  alloc_stats allocs;
+  uint32_t warmup;
+  profile_window profile;
 };
 
 behavior sending_client(stateful_actor<c_state>* self);
 
+// ends the run and waits for the summary of the server
+behavior finishing_client(stateful_actor<c_state>* self) {
+  auto& s = self->state;
+  s.profile.leave(self);
+  auto sent_us = static_cast<uint64_t>(
+    chrono::duration_cast<chrono::microseconds>(
+      chrono::steady_clock::now() - s.start).count());
+  self->request(s.srv, chrono::seconds(10), fin_atom::value,
+                static_cast<uint64_t>(s.seq), sent_us).then(
+    [=](const run_summary& summary) {
+      aout(self) << render(summary) << endl;
+      aout(self) << "Client quitting." << endl;
+      self->quit();
+    },
+    [=](error& err) {
+      aout(self) << "No run summary from server: "
+                 << self->system().render(err) << endl;
+      self->quit();
+    }
+  );
+  return {
+    [=](ping_atom) {
+      // done sending
+    },
+    [=](reset_atom) {
+      // done sending
+    },
+    [=](shutdown_atom) {
+      self->quit();
+    }
+  };
+}
+
 behavior handshake_client(stateful_actor<c_state>* self, actor srv,
                           vector<char> payload, uint32_t packets,
-                          uint32_t bundle, caf::duration timeout) {
+                          uint32_t bundle, caf::duration timeout,
+                          uint32_t blocks, uint32_t warmup) {
   auto& s = self->state;
   s.count = 0;
   s.seq = 0;
-  s.srv = srv;
   s.payload = std::move(payload);
   s.packets = packets;
   s.bundle = bundle;
   s.timeout = timeout;
+  s.blocks = blocks;
+  s.current_block = 0;
+  s.warmup = warmup;
   self->send(srv, start_atom::value, packets);
   return {
     [=](start_atom) {
+      // the directory delegates the handshake to the sink we should target
+      self->state.srv = actor_cast<actor>(self->current_sender());
       self->become(sending_client(self));
     }
   };
@@ -190,6 +668,10 @@ behavior handshake_client(stateful_actor<c_state>* self, actor srv,
 
 behavior sending_client(stateful_actor<c_state>* self) {
   aout(self) << "Sending " << self->state.packets << " packets/s" << endl;
+  self->state.start = chrono::steady_clock::now();
+  self->state.allocs = alloc_totals();
+  if (self->state.warmup == 0)
+    self->state.profile.enter(self, "steady-state");
   self->delayed_send(self, self->state.timeout, ping_atom::value);
   self->delayed_send(self, interval, reset_atom::value);
   return {
@@ -200,14 +682,27 @@ behavior sending_client(stateful_actor<c_state>* self) {
       else
         self->send(self, ping_atom::value);
       if (self->state.count < s.packets) {
+        HOT_PATH_BEGIN(send);
         self->send(s.srv, s.payload, s.seq, caf::make_timestamp());
         ++s.count;
         ++s.seq;
+        HOT_PATH_END(send);
       }
     },
     [=](reset_atom) {
       self->delayed_send(self, interval, reset_atom::value);
-      self->state.count = 0;
+      auto& s = self->state;
+      // counters are process-wide, i.e., include the sinks with --local
+      if (alloc_tracking)
+        aout(self) << "Sent " << s.count << " packets/s"
+                   << alloc_report(s.allocs, s.count) << "." << endl;
+      if (++s.current_block >= s.blocks) {
+        self->become(finishing_client(self));
+      } else {
+        if (s.current_block >= s.warmup)
+          s.profile.enter(self, "steady-state");
+        s.count = 0;
+      }
     },
     [=](shutdown_atom) {
       self->quit();
@@ -219,17 +714,64 @@ behavior sending_client(stateful_actor<c_state>* self) {
 //  MAIN
 // -----------------------------------------------------------------------------
 
+// sinks plus the directory handing them out to clients
+actor spawn_sinks(actor_system& system, const config& cfg, bool detach) {
+  processing work;
+  work.iterations = cfg.cost > 0 ? cfg.cost * iterations_per_us() : 0;
+  work.checksum = cfg.checksum;
+  auto coll = system.spawn(collector, cfg.sinks);
+  vector<actor> sinks;
+  for (uint32_t i = 0; i < cfg.sinks; ++i)
+    sinks.emplace_back(
+      detach ? system.spawn<detached>(sink, i, coll, work, cfg.stages, detach,
+                                      cfg.warmup)
+             : system.spawn(sink, i, coll, work, cfg.stages, detach,
+                            cfg.warmup));
+  return system.spawn(directory, std::move(sinks));
+}
+
+void spawn_senders(actor_system& system, const config& cfg, bool detach,
+                   const actor& dest, const vector<char>& payload,
+                   function<void(const actor&)> f = nullptr) {
+  auto timeout = caf::duration{(one * cfg.bundle / cfg.rate) * 2};
+  for (uint32_t i = 0; i < cfg.senders; ++i) {
+    auto c = detach ? system.spawn<detached>(handshake_client, dest, payload,
+                                             cfg.rate, cfg.bundle, timeout,
+                                             cfg.blocks, cfg.warmup)
+                    : system.spawn(handshake_client, dest, payload, cfg.rate,
+                                   cfg.bundle, timeout, cfg.blocks,
+                                   cfg.warmup);
+    if (f)
+      f(c);
+  }
+}
+
 void caf_main(actor_system& system, const config& cfg) {
   vector<char> payload(cfg.payload, 'a');
+  // only the classic one-to-one setup bypasses the scheduler, topologies
+  // need the work-stealing scheduler (see caf#scheduler.max-threads)
+  auto detach = cfg.senders == 1 && cfg.sinks == 1 && !cfg.local;
+  if (cfg.senders == 0 || cfg.sinks == 0) {
+    cerr << "Need at least one sender and one sink." << endl;
+    return;
+  }
   if (cfg.debug) {
     vector<char> buf;
     binary_serializer sink{system, buf};
     auto e = sink(payload, 1u, caf::make_timestamp());
     cout << "Message will be " << (buf.size() + caf::io::basp::header_size)
          << " bytes" << endl;
+  } else if (cfg.local) { // senders and sinks in one process
+    auto dir = spawn_sinks(system, cfg, detach);
+    scoped_actor self{system};
+    spawn_senders(system, cfg, detach, dir, payload,
+                  [&](const actor& c) { self->monitor(c); });
+    for (uint32_t i = 0; i < cfg.senders; ++i)
+      self->receive([](const down_msg&) {});
+    anon_send(dir, shutdown_atom::value);
   } else {
     if (cfg.server) { // server
-      auto s = system.spawn<detached>(idle_server);
+      auto s = spawn_sinks(system, cfg, detach);
       auto ep = cfg.udp ? system.middleman().publish_udp(s, cfg.port, nullptr, true)
                         : system.middleman().publish(s, cfg.port, nullptr, true);
       if (ep) {
@@ -249,10 +791,7 @@ void caf_main(actor_system& system, const config& cfg) {
                   << "':" << system.render(es.error()) << std::endl;
         return;
       }
-      system.spawn<detached>(handshake_client, std::move(*es), std::move(payload),
-                             cfg.rate, cfg.bundle,
-                             //caf::duration{chrono::milliseconds{1}});
-                             caf::duration{(one * cfg.bundle / cfg.rate) * 2});
+      spawn_senders(system, cfg, detach, *es, payload);
       /*
       auto sleep_time = one / cfg.rate;
       scoped_actor self{system};
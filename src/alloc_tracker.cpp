@@ -0,0 +1,121 @@
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+
+#include "alloc_tracker.hpp"
+
+namespace {
+
+// Counters are only written by their own thread, other threads read them when
+// summing up the totals. Nodes are never released to allow reading the
+// numbers of terminated threads and to keep thread exit allocation free.
+struct thread_counters {
+  std::atomic<uint64_t> allocations;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> deallocations;
+  thread_counters* next;
+};
+
+std::mutex registry_mtx;
+thread_counters* registry_head = nullptr;
+
+thread_local thread_counters* local_counters = nullptr;
+
+thread_counters& counters() {
+  if (local_counters == nullptr) {
+    // must not call operator new from here
+    auto mem = std::malloc(sizeof(thread_counters));
+    if (mem == nullptr)
+      std::abort();
+    auto ptr = new (mem) thread_counters;
+    ptr->allocations = 0;
+    ptr->bytes = 0;
+    ptr->deallocations = 0;
+    std::lock_guard<std::mutex> guard{registry_mtx};
+    ptr->next = registry_head;
+    registry_head = ptr;
+    local_counters = ptr;
+  }
+  return *local_counters;
+}
+
+// single writer, no need for atomic read-modify-write
+void bump(std::atomic<uint64_t>& x, uint64_t n) {
+  x.store(x.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void* allocate(std::size_t n) {
+  auto& c = counters();
+  bump(c.allocations, 1);
+  bump(c.bytes, n);
+  return std::malloc(n == 0 ? 1 : n);
+}
+
+void deallocate(void* ptr) {
+  if (ptr == nullptr)
+    return;
+  bump(counters().deallocations, 1);
+  std::free(ptr);
+}
+
+} // namespace anonymous
+
+alloc_stats alloc_totals() {
+  alloc_stats result{0, 0, 0};
+  std::lock_guard<std::mutex> guard{registry_mtx};
+  for (auto c = registry_head; c != nullptr; c = c->next) {
+    result.allocations += c->allocations.load(std::memory_order_relaxed);
+    result.bytes += c->bytes.load(std::memory_order_relaxed);
+    result.deallocations += c->deallocations.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+// -----------------------------------------------------------------------------
+//  GLOBAL OPERATOR NEW/DELETE
+// -----------------------------------------------------------------------------
+
+void* operator new(std::size_t n) {
+  if (auto ptr = allocate(n))
+    return ptr;
+  throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t n) {
+  if (auto ptr = allocate(n))
+    return ptr;
+  throw std::bad_alloc{};
+}
+
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept {
+  return allocate(n);
+}
+
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept {
+  return allocate(n);
+}
+
+void operator delete(void* ptr) noexcept {
+  deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+  deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  deallocate(ptr);
+}
@@ -7,6 +7,10 @@
 
 #include "caf/io/broker.hpp"
 
+#include "run_summary.hpp"
+#include "alloc_tracker.hpp"
+#include "profiling.hpp"
+
 using namespace std;
 using namespace caf;
 using namespace caf::io;
@@ -18,9 +22,6 @@ using reset_atom = caf::atom_constant<atom("reset")>;
 using start_atom = caf::atom_constant<atom("start")>;
 using shutdown_atom = caf::atom_constant<atom("shutdown")>;
 
-//  8 bytes sequence number + annotations
-constexpr uint32_t message_overhead = 10;
-
 constexpr auto interval = std::chrono::seconds(1);
 
 } // namespace anonymous
@@ -38,6 +39,7 @@ public:
   uint32_t bundle = 1;
   uint32_t payload = 1024;
   uint32_t blocks = 10;
+  uint32_t warmup = 1;
   config() {
     load<io::middleman>();
     set("middleman.enable-tcp", true);
@@ -51,11 +53,24 @@ public:
       .add(payload, "payload,p", "set payload of each message in bytes "
                                  "(default: 1024 bytes)")
       .add(blocks, "blocks,B", "set number of 1s blocks to send (default: 10)")
+      .add(warmup, "warmup,W", "set number of 1s blocks excluded from "
+                               "profiling at the start (default: 1)")
       .add(is_server, "server,s", "start a server");
   }
 };
 
 
+// size of a serialized data record, both sides need the same value because
+// the server reads records of exactly this size and the client pads its fin
+// record to it
+uint32_t data_record_size(actor_system& sys, uint32_t payload) {
+  vector<char> buf;
+  binary_serializer bs{sys, buf};
+  bs(to_byte(record_type::data), vector<char>(payload, 'a'), uint64_t{0},
+     caf::make_timestamp());
+  return static_cast<uint32_t>(buf.size());
+}
+
 // -----------------------------------------------------------------------------
 //  SERVER BROKER
 // -----------------------------------------------------------------------------
@@ -69,26 +84,71 @@ struct s_state {
   // deserialization stuff
   vector<char> payload;
   bool reporting;
+  // a reset_atom is pending
+  bool ticking;
+  // exact numbers since the client connected
+  run_totals run;
+  // allocation counters at the last report
+  alloc_stats allocs;
+  // intervals with data in the current run
+  uint32_t intervals;
+  profile_window profile;
 };
 
-behavior server(stateful_broker<s_state>* self) {
+// resets all counters for the next client, a pending tick stays scheduled
+void end_run(stateful_broker<s_state>* self) {
+  auto& s = self->state;
+  s.run.reset();
+  s.next = 0;
+  s.received = 0;
+  s.bytes = 0;
+  s.lost = 0;
+  s.reporting = false;
+  s.intervals = 0;
+  s.profile.leave(self);
+}
+
+// answers the fin record on the connection and resets for the next client
+void finish_run(stateful_broker<s_state>* self, connection_handle hdl,
+                binary_deserializer& bd) {
+  auto& s = self->state;
+  uint64_t sent;
+  uint64_t sent_us;
+  bd(sent, sent_us);
+  auto summary = s.run.summarize(sent, sent_us);
+  aout(self) << render(summary) << endl;
+  binary_serializer bs{self->context(), self->wr_buf(hdl)};
+  bs(to_byte(record_type::summary), summary);
+  self->flush(hdl);
+  end_run(self);
+}
+
+behavior server(stateful_broker<s_state>* self, uint32_t record_size,
+                uint32_t warmup) {
   aout(self) << "Server running, waiting for clients!" << endl;
   // initialize state
   auto& s = self->state;
   s.packets_per_interval = 0;
   s.bytes = 0;
+  s.received = 0;
   s.lost = 0;
-  s.bytes = 0;
   s.next = 0;
   s.reporting = false;
+  s.ticking = false;
+  s.allocs = alloc_totals();
+  s.intervals = 0;
   return {
     [=](new_connection_msg& msg) {
       if (self->state.reporting == true) {
         aout(self) << "No support for multiple enpoints." << endl;
       } else {
         aout(self) << "New client, let's start reporting." << endl;
-        self->delayed_send(self, interval, reset_atom::value);
-        self->configure_read(msg.handle, receive_policy::exactly(1024));
+        // the tick of the previous client may still be on its way
+        if (!self->state.ticking) {
+          self->state.ticking = true;
+          self->delayed_send(self, interval, reset_atom::value);
+        }
+        self->configure_read(msg.handle, receive_policy::exactly(record_size));
         binary_serializer bs{self->context(), self->wr_buf(msg.handle)};
         bs(start_atom::value);
         self->flush(msg.handle);
@@ -97,18 +157,29 @@ behavior server(stateful_broker<s_state>* self) {
     },
     [=](connection_closed_msg&) {
       aout(self) << "Client lost." << endl;
-      self->state.reporting = false;
+      end_run(self);
     },
     [=](const new_data_msg& msg) {
-      // regular data packet
       auto& s = self->state;
+      binary_deserializer bd{self->context(), msg.buf};
+      uint8_t type;
+      bd(type);
+      if (type == to_byte(record_type::fin)) {
+        finish_run(self, msg.handle, bd);
+        return;
+      }
+      // regular data packet
+      HOT_PATH_BEGIN(receive);
       // count messages that arrived
       ++s.received;
       // count bytes that arrived
       s.bytes += msg.buf.size();
-      binary_deserializer bd{self->context(), msg.buf};
       uint64_t seq;
-      bd(s.payload, seq);
+      caf::timestamp ts;
+      bd(s.payload, seq, ts);
+      s.run.add(msg.buf.size());
+      s.run.add_latency(chrono::duration_cast<chrono::microseconds>(
+        caf::make_timestamp() - ts).count());
       if (seq == s.next) {
         // expected message
         ++s.next;
@@ -120,17 +191,23 @@ behavior server(stateful_broker<s_state>* self) {
         // previously lost message
         --s.lost;
       }
+      HOT_PATH_END(receive);
     },
     [=](reset_atom) {
       auto& s = self->state;
       if (s.reporting) {
         self->delayed_send(self, interval, reset_atom::value);
+        if (s.received > 0 && ++s.intervals > warmup)
+          s.profile.enter(self, "steady-state");
         aout(self) << "Received " << s.received << " received, lost "
                    << (s.lost * 1.0 / s.received)
                    << " --> " << (s.bytes * 8 / (1024.0 * 1024.0) )
-                   << " Mbits/s." << std::endl;
+                   << " Mbits/s" << alloc_report(s.allocs, s.received)
+                   << "." << std::endl;
       } else {
         aout(self) << "Waiting for new client ... " << endl;
+        s.allocs = alloc_totals();
+        s.ticking = false;
       }
       s.received = 0;
       s.bytes = 0;
@@ -156,12 +233,75 @@ struct c_state {
   uint32_t blocks;
   uint32_t current_block;
   connection_handle servant;
+  bool started;
+  chrono::steady_clock::time_point start;
+  uint32_t fin_attempts;
+  uint32_t record_size;
+  // allocation counters at the last report
+  alloc_stats allocs;
+  uint32_t warmup;
+  profile_window profile;
 };
 
+// sends the padded fin record and waits for the summary on the connection
+behavior finishing_client(stateful_broker<c_state>* self) {
+  auto& s = self->state;
+  s.profile.leave(self);
+  auto sent_us = static_cast<uint64_t>(
+    chrono::duration_cast<chrono::microseconds>(
+      chrono::steady_clock::now() - s.start).count());
+  // pad the fin record to the size of data records
+  auto& buf = self->wr_buf(s.servant);
+  auto offset = buf.size();
+  binary_serializer bs{self->context(), buf};
+  bs(to_byte(record_type::fin), s.seq, sent_us);
+  buf.resize(offset + s.record_size);
+  self->flush(s.servant);
+  self->configure_read(s.servant,
+                       receive_policy::exactly(1 + run_summary_size));
+  s.fin_attempts = 0;
+  return {
+    [=](new_data_msg& msg) {
+      binary_deserializer bd{self->context(), msg.buf};
+      uint8_t type;
+      bd(type);
+      if (type != to_byte(record_type::summary))
+        return;
+      run_summary summary;
+      bd(summary);
+      aout(self) << render(summary) << endl;
+      aout(self) << "Client quitting." << endl;
+      self->quit();
+    },
+    [=](ping_atom) {
+      // done sending
+    },
+    [=](data_transferred_msg&) {
+      // done sending
+    },
+    [=](reset_atom) {
+      if (++self->state.fin_attempts >= 3) {
+        aout(self) << "No run summary from server, client quitting." << endl;
+        self->quit();
+      } else {
+        self->delayed_send(self, interval, reset_atom::value);
+      }
+    },
+    [=](connection_closed_msg&) {
+      aout(self) << "Server closed the connection." << endl;
+      self->quit();
+    },
+    [=](shutdown_atom) {
+      self->quit();
+    }
+  };
+}
+
 
 behavior client(stateful_broker<c_state>* self, const string& host,
-                uint16_t port, uint32_t payload, uint32_t packets,
-                uint32_t bundle, uint32_t blocks) {
+                uint16_t port, uint32_t payload, uint32_t record_size,
+                uint32_t packets, uint32_t bundle, uint32_t blocks,
+                uint32_t warmup) {
   auto es = self->add_tcp_scribe(host, port);
   if (!es) {
     cerr << "Failed to create client for " << host << ":" << port
@@ -175,13 +315,24 @@ behavior client(stateful_broker<c_state>* self, const string& host,
   s.count = 0;
   s.seq = 0;
   s.payload = vector<char>(payload, 'a');
+  s.record_size = record_size;
   s.packets = packets;
   s.bundle = bundle;
   s.blocks = blocks;
   s.current_block = 0;
+  s.tmp = 0;
+  s.started = false;
+  s.warmup = warmup;
   return {
     [=](new_data_msg& msg) {
       auto& s = self->state;
+      if (s.started)
+        return;
+      s.started = true;
+      s.start = chrono::steady_clock::now();
+      s.allocs = alloc_totals();
+      if (s.warmup == 0)
+        s.profile.enter(self, "steady-state");
       aout(self) << "Response from server, starting to send" << endl
                  << "targeting " << self->state.packets << " packets/s." << endl;
       s.servant = msg.handle;
@@ -193,12 +344,15 @@ behavior client(stateful_broker<c_state>* self, const string& host,
     [=](ping_atom) {
       auto& s = self->state;
       if (s.count < s.packets) {
+        HOT_PATH_BEGIN(send);
         // serialize into new message buffer
         binary_serializer bs{self->context(), self->wr_buf(s.servant)};
-        bs(s.payload, s.seq);
+        bs(to_byte(record_type::data), s.payload, s.seq,
+           caf::make_timestamp());
         self->flush(s.servant);
         ++s.count;
         ++s.seq;
+        HOT_PATH_END(send);
       }
     },
     [=](data_transferred_msg& msg) {
@@ -206,23 +360,30 @@ behavior client(stateful_broker<c_state>* self, const string& host,
       ++s.tmp;
       if (s.tmp >= s.bundle) {
         while (s.count < s.packets && s.tmp > 0) {
+          HOT_PATH_BEGIN(send);
           binary_serializer bs{self->context(), self->wr_buf(msg.handle)};
-          bs(s.payload, s.seq);
+          bs(to_byte(record_type::data), s.payload, s.seq,
+             caf::make_timestamp());
           self->flush(s.servant);
           ++s.count;
           ++s.seq;
           --s.tmp;
+          HOT_PATH_END(send);
         }
       }
     },
     [=](reset_atom) {
       self->delayed_send(self, interval, reset_atom::value);
-      aout(self) << "Sent " << self->state.count << " packets/s." << endl;
+      aout(self) << "Sent " << self->state.count << " packets/s"
+                 << alloc_report(self->state.allocs, self->state.count)
+                 << "." << endl;
       if (++self->state.current_block >= self->state.blocks) {
-        aout(self) << "Client quitting." << endl;
-        self->quit();
+        self->become(finishing_client(self));
       } else {
-        self->state.count = 0;
+        auto& s = self->state;
+        if (s.current_block >= s.warmup)
+          s.profile.enter(self, "steady-state");
+        s.count = 0;
         for (uint32_t i = 0; i < (2 * s.bundle); ++i)
           self->send(self, ping_atom::value);
       }
@@ -242,21 +403,24 @@ void caf_main(actor_system& system, const config& cfg) {
     cerr << "Please enable TCP in CAF." << endl;
     return;
   }
+  if (cfg.payload < record_overhead) {
+    cerr << "Payload needs to be at least " << record_overhead
+         << " bytes." << endl;
+    return;
+  }
+  uint32_t payload = cfg.payload - record_overhead;
+  auto record_size = data_record_size(system, payload);
   if (cfg.is_server) { // server
-    auto es = system.middleman().spawn_server(server, cfg.port);
+    auto es = system.middleman().spawn_server(server, cfg.port, record_size,
+                                              cfg.warmup);
     if (!es) {
       cerr << "Failed to spawn server: " << system.render(es.error())
            << "." << endl;
     }
   } else { // client
-    if (cfg.payload < message_overhead) {
-      cerr << "Payload needs to be at least " << message_overhead
-           << " bytes." << endl;
-      return;
-    }
-    uint32_t payload = cfg.payload - message_overhead;
-    system.middleman().spawn_broker(client, cfg.host, cfg.port,
-                                    payload, cfg.rate, cfg.bundle, cfg.blocks);
+    system.middleman().spawn_broker(client, cfg.host, cfg.port, payload,
+                                    record_size, cfg.rate, cfg.bundle,
+                                    cfg.blocks, cfg.warmup);
   }
 }
 
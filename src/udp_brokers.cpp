@@ -7,6 +7,10 @@
 
 #include "caf/io/broker.hpp"
 
+#include "run_summary.hpp"
+#include "alloc_tracker.hpp"
+#include "profiling.hpp"
+
 using namespace std;
 using namespace caf;
 using namespace caf::io;
@@ -18,9 +22,6 @@ using reset_atom = caf::atom_constant<atom("reset")>;
 using start_atom = caf::atom_constant<atom("start")>;
 using shutdown_atom = caf::atom_constant<atom("shutdown")>;
 
-//  8 bytes sequence number + annotations
-constexpr size_t message_overhead = 10;
-
 // report statistics every ...
 constexpr auto interval = std::chrono::seconds(1);
 
@@ -39,6 +40,7 @@ public:
   uint32_t bundle = 1;
   uint32_t payload = 1024;
   uint32_t blocks = 10;
+  uint32_t warmup = 1;
   config() {
     load<io::middleman>();
     set("middleman.enable-udp", true);
@@ -52,6 +54,8 @@ public:
       .add(payload, "payload,p", "set payload of each message in bytes "
                                  "(default: 1024 bytes)")
       .add(blocks, "blocks,B", "set number of 1s blocks to send (default: 10)")
+      .add(warmup, "warmup,W", "set number of 1s blocks excluded from "
+                               "profiling at the start (default: 1)")
       .add(is_server, "server,s", "start a server");
   }
 };
@@ -68,9 +72,48 @@ struct statistics {
   uint32_t next;
   // deserialization stuff
   vector<char> payload;
+  // exact numbers since the first message of the current client
+  run_totals run;
+  // repeated on retransmitted fin records
+  vector<char> last_summary;
+  datagram_handle last_fin_hdl;
+  uint64_t last_fin_sent;
+  // allocation counters at the last report
+  alloc_stats allocs;
+  // intervals with data in the current run
+  uint32_t intervals;
+  profile_window profile;
 };
 
-behavior server(stateful_broker<statistics>* self, uint16_t port) {
+// answers a fin datagram, retransmitted fins get the cached summary again
+void finish_run(stateful_broker<statistics>* self, datagram_handle hdl,
+                binary_deserializer& bd) {
+  auto& s = self->state;
+  uint64_t sent;
+  uint64_t sent_us;
+  bd(sent, sent_us);
+  // a retransmitted fin repeats the handle and the count of the previous one
+  auto retransmit = !s.last_summary.empty() && hdl == s.last_fin_hdl
+                    && sent == s.last_fin_sent;
+  if (!retransmit) {
+    s.last_fin_hdl = hdl;
+    s.last_fin_sent = sent;
+    auto summary = s.run.summarize(sent, sent_us);
+    aout(self) << render(summary) << endl;
+    s.last_summary.clear();
+    binary_serializer bs{self->context(), s.last_summary};
+    bs(to_byte(record_type::summary), summary);
+    s.run.reset();
+    s.next = 0;
+    s.intervals = 0;
+    s.profile.leave(self);
+  }
+  self->enqueue_datagram(hdl, s.last_summary);
+  self->flush(hdl);
+}
+
+behavior server(stateful_broker<statistics>* self, uint16_t port,
+                uint32_t warmup) {
   // open local endpoint
   auto epair = self->add_udp_datagram_servant(port, nullptr, true);
   if (!epair) {
@@ -82,21 +125,35 @@ behavior server(stateful_broker<statistics>* self, uint16_t port) {
   // initialize state
   auto& s = self->state;
   s.bytes = 0;
+  s.received = 0;
   s.lost = 0;
-  s.bytes = 0;
   s.next = 0;
+  s.allocs = alloc_totals();
+  s.intervals = 0;
+  s.last_fin_sent = 0;
   self->delayed_send(self, interval, reset_atom::value);
   return {
     [=](const new_datagram_msg& msg) {
-      // regular data packet
       auto& s = self->state;
+      binary_deserializer bd{self->context(), msg.buf};
+      uint8_t type;
+      bd(type);
+      if (type == to_byte(record_type::fin)) {
+        finish_run(self, msg.handle, bd);
+        return;
+      }
+      // regular data packet
+      HOT_PATH_BEGIN(receive);
       // count messages that arrived
       ++s.received;
       // count bytes that arrived
       s.bytes += msg.buf.size();
-      binary_deserializer bd{self->context(), msg.buf};
       uint64_t seq;
-      bd(s.payload, seq);
+      caf::timestamp ts;
+      bd(s.payload, seq, ts);
+      s.run.add(msg.buf.size());
+      s.run.add_latency(chrono::duration_cast<chrono::microseconds>(
+        caf::make_timestamp() - ts).count());
       if (seq == s.next) {
         // expected message
         ++s.next;
@@ -108,14 +165,23 @@ behavior server(stateful_broker<statistics>* self, uint16_t port) {
         // previously lost message
         --s.lost;
       }
+      HOT_PATH_END(receive);
     },
     [=](reset_atom) {
       self->delayed_send(self, interval, reset_atom::value);
       auto& s = self->state;
+      // stay quiet between clients
+      if (s.received == 0) {
+        s.allocs = alloc_totals();
+        return;
+      }
+      if (++s.intervals > warmup)
+        s.profile.enter(self, "steady-state");
       aout(self) << "Received " << s.received << " received, lost "
                  << (s.lost * 1.0 / s.received)
                  << " --> " << (s.bytes * 8 / (1024.0 * 1024.0) )
-                 << " Mbits/s" << std::endl;
+                 << " Mbits/s" << alloc_report(s.allocs, s.received)
+                 << std::endl;
       s.received = 0;
       s.bytes = 0;
       s.lost = 0;
@@ -137,12 +203,77 @@ struct c_state {
   stack<vector<char>> cache;
   uint32_t blocks;
   uint32_t current_block;
+  chrono::steady_clock::time_point start;
+  uint64_t sent_us;
+  uint32_t fin_attempts;
+  // allocation counters at the last report
+  alloc_stats allocs;
+  uint32_t warmup;
+  profile_window profile;
 };
 
+// tells the server the run is over, repeated until the summary arrives
+void send_fin(stateful_broker<c_state>* self) {
+  auto& s = self->state;
+  vector<char> buf;
+  binary_serializer bs{self->context(), buf};
+  bs(to_byte(record_type::fin), s.seq, s.sent_us);
+  self->enqueue_datagram(s.servant, std::move(buf));
+  self->flush(s.servant);
+}
+
+// sends fin datagrams once per interval until the summary arrives
+behavior finishing_client(stateful_broker<c_state>* self) {
+  auto& s = self->state;
+  s.profile.leave(self);
+  s.sent_us = static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(
+    chrono::steady_clock::now() - s.start).count());
+  s.fin_attempts = 1;
+  send_fin(self);
+  return {
+    [=](const new_datagram_msg& msg) {
+      binary_deserializer bd{self->context(), msg.buf};
+      uint8_t type;
+      bd(type);
+      if (type != to_byte(record_type::summary))
+        return;
+      run_summary summary;
+      bd(summary);
+      aout(self) << render(summary) << endl;
+      aout(self) << "Client quitting." << endl;
+      self->quit();
+    },
+    [=](ping_atom) {
+      // done sending
+    },
+    [=](datagram_sent_msg&) {
+      // done sending
+    },
+    [=](reset_atom) {
+      auto& s = self->state;
+      if (s.fin_attempts >= 3) {
+        aout(self) << "No run summary from server, client quitting." << endl;
+        self->quit();
+        return;
+      }
+      self->delayed_send(self, interval, reset_atom::value);
+      ++s.fin_attempts;
+      send_fin(self);
+    },
+    [=](datagram_servant_closed_msg&) {
+      aout(self) << "ERROR: datagram servant closed" << endl;
+      self->quit();
+    },
+    [=](shutdown_atom) {
+      self->quit();
+    }
+  };
+}
+
 
 behavior client(stateful_broker<c_state>* self, const string& h, uint16_t p,
                 vector<char> payload, uint32_t packets, uint32_t bundle,
-                uint32_t blocks) {
+                uint32_t blocks, uint32_t warmup) {
   auto& s = self->state;
   aout(self) << "remote endpoint at " << h << ":" << p << endl;
   // create endpoint to contact server
@@ -158,6 +289,11 @@ behavior client(stateful_broker<c_state>* self, const string& h, uint16_t p,
   s.seq = 0;
   s.blocks = blocks;
   s.current_block = 0;
+  s.start = chrono::steady_clock::now();
+  s.allocs = alloc_totals();
+  s.warmup = warmup;
+  if (warmup == 0)
+    s.profile.enter(self, "steady-state");
   aout(self) << "targeting " << packets << " packets/s" << endl;
   for (uint32_t i = 0; i < (2 * bundle); ++i)
     self->send(self, ping_atom::value);
@@ -167,24 +303,28 @@ behavior client(stateful_broker<c_state>* self, const string& h, uint16_t p,
     [=](ping_atom) {
       auto& s = self->state;
       if (s.count < packets) {
+        HOT_PATH_BEGIN(send);
         if (s.cache.empty()) {
           // serialize into new message buffer
           vector<char> buf;
           binary_serializer bs{self->context(), buf};
-          bs(payload, s.seq);
+          bs(to_byte(record_type::data), payload, s.seq,
+             caf::make_timestamp());
           self->enqueue_datagram(s.servant, std::move(buf));
           self->flush(s.servant);
         } else {
           auto& next = s.cache.top();
           next.clear();
           binary_serializer bs{self->context(), next};
-          bs(payload, s.seq);
+          bs(to_byte(record_type::data), payload, s.seq,
+             caf::make_timestamp());
           self->enqueue_datagram(s.servant, move(next));
           self->flush(s.servant);
           s.cache.pop();
         }
         ++s.count;
         ++s.seq;
+        HOT_PATH_END(send);
       }
     },
     [=](datagram_sent_msg& msg) {
@@ -192,25 +332,31 @@ behavior client(stateful_broker<c_state>* self, const string& h, uint16_t p,
       s.cache.emplace(move(msg.buf));
       if (s.cache.size() >= bundle) {
         while (s.count < packets && !s.cache.empty()) {
+          HOT_PATH_BEGIN(send);
           auto& next = s.cache.top();
           next.clear();
           binary_serializer bs{self->context(), next};
-          bs(payload, s.seq);
+          bs(to_byte(record_type::data), payload, s.seq,
+             caf::make_timestamp());
           self->enqueue_datagram(s.servant, move(next));
           self->flush(s.servant);
           ++s.count;
           ++s.seq;
           s.cache.pop();
+          HOT_PATH_END(send);
         }
       }
     },
     [=](reset_atom) {
       self->delayed_send(self, interval, reset_atom::value);
-      aout(self) << "sent " << self->state.count << " packets/s." << endl;
+      aout(self) << "sent " << self->state.count << " packets/s"
+                 << alloc_report(self->state.allocs, self->state.count)
+                 << "." << endl;
       if (++self->state.current_block >= self->state.blocks) {
-        aout(self) << "Client quitting." << endl;
-        self->quit();
+        self->become(finishing_client(self));
       } else {
+        if (self->state.current_block >= self->state.warmup)
+          self->state.profile.enter(self, "steady-state");
         self->state.count = 0;
         for (uint32_t i = 0; i < (2 * bundle); ++i)
           self->send(self, ping_atom::value);
@@ -236,17 +382,17 @@ void caf_main(actor_system& system, const config& cfg) {
     return;
   }
   if (cfg.is_server) { // server
-    system.middleman().spawn_broker(server, cfg.port);
+    system.middleman().spawn_broker(server, cfg.port, cfg.warmup);
   } else { // client
-    if (cfg.payload < message_overhead) {
-      cerr << "Payload needs to be at least " << message_overhead
+    if (cfg.payload < record_overhead) {
+      cerr << "Payload needs to be at least " << record_overhead
            << " bytes" << endl;
       return;
     }
-    vector<char> payload(cfg.payload - message_overhead, 'a');
+    vector<char> payload(cfg.payload - record_overhead, 'a');
     system.middleman().spawn_broker(client, cfg.host, cfg.port,
                                     move(payload), cfg.rate, cfg.bundle,
-                                    cfg.blocks);
+                                    cfg.blocks, cfg.warmup);
   }
 }
 